@@ -0,0 +1,191 @@
+#!/usr/bin/env python3
+"""Decode scale traces captured by the feeder and model a feed on them.
+
+Get a trace by sending anything to home/cat_feeder/trace/download and
+appending the trace/data payloads, in order, to a file. Then:
+
+    trace_replay.py trace.bin --dump         # CSV of every record
+    trace_replay.py trace.bin --amount 30    # replay a weight based feed
+
+This is NOT a driver for the firmware code. simulate() is a hand kept
+Python model of loop(), feed(), endFeed(), getAccurateWeight() and
+detectClogging() in src/main.cpp, and Replay follows readReplaySample() and
+advanceReplay(). Any change to that C++ has to be ported here by hand or
+the model drifts. Use it to try settings against real traces; check filter
+or detection code changes with an on-device replay (trace/replay).
+"""
+import argparse
+import struct
+import sys
+from collections import Counter
+
+HEADER = struct.Struct("<4sHHii")
+RECORD = struct.Struct("<BBHi")
+MAGIC = b"CFT1"
+TRACE_SAMPLE, TRACE_PUSH, TRACE_PULL = 0, 1, 2
+TYPE_NAMES = {TRACE_SAMPLE: "sample", TRACE_PUSH: "push", TRACE_PULL: "pull"}
+Q_BITS = 24
+CALIB_MIN = 1000  # SCALE_CALIB_MIN
+
+STEPS = 3200
+DEGREE_STEPS = STEPS // 360
+
+
+def load(path):
+    with open(path, "rb") as f:
+        data = f.read()
+    if len(data) < HEADER.size:
+        sys.exit("trace too short")
+    magic, version, record_size, calibration, scale_zero = HEADER.unpack_from(data)
+    if magic != MAGIC or record_size != RECORD.size:
+        sys.exit("not a feeder trace (magic %r, record size %d)" % (magic, record_size))
+    if calibration < CALIB_MIN:
+        sys.exit("invalid calibration %d in trace header" % calibration)
+    body = data[HEADER.size:]
+    records = [RECORD.unpack_from(body, i) for i in range(0, len(body) - len(body) % RECORD.size, RECORD.size)]
+    return {"version": version, "calibration": calibration, "scale_zero": scale_zero}, records
+
+
+def raw_to_grams(raw, calibration):
+    q = (1000 << Q_BITS) // calibration
+    return (raw * q + (1 << (Q_BITS - 1))) >> Q_BITS
+
+
+def dump(header, records):
+    print("t_ms,type,value,grams")
+    t = 0
+    for rtype, _, delta, value in records:
+        t += delta
+        grams = raw_to_grams(value, header["calibration"]) - header["scale_zero"] if rtype == TRACE_SAMPLE else ""
+        print("%d,%s,%d,%s" % (t, TYPE_NAMES.get(rtype, rtype), value, grams))
+
+
+class Replay:
+    """Trace cursor, same rules as readReplaySample()/advanceReplay()."""
+
+    def __init__(self, header, records, calibration=None, scale_zero=None):
+        self.records = records
+        self.pos = 0
+        self.sample = 0
+        self.live_position = 0
+        self.trace_position = 0
+        self.done = False
+        self.calibration = header["calibration"] if calibration is None else calibration
+        self.scale_zero = header["scale_zero"] if scale_zero is None else scale_zero
+
+    def peek(self):
+        return self.records[self.pos] if self.pos < len(self.records) else None
+
+    def get_weight(self):
+        record = self.peek()
+        if record and record[0] == TRACE_SAMPLE:
+            self.sample = record[3]
+            self.pos += 1
+        return raw_to_grams(self.sample, self.calibration) - self.scale_zero
+
+    def step(self, steps, clockwise):
+        self.live_position += -steps if clockwise else steps
+        while self.trace_position < self.live_position:
+            record = self.peek()
+            if record is None:
+                self.done = True
+                return
+            if record[0] == TRACE_SAMPLE:
+                self.sample = record[3]
+            else:
+                self.trace_position += -record[3] if record[0] == TRACE_PULL else record[3]
+            self.pos += 1
+
+
+def accurate_weight(replay, measures):
+    counts = Counter()
+    mode, max_count = 0, 0
+    for _ in range(measures):
+        measure = replay.get_weight()
+        counts[measure] += 1
+        if counts[measure] > max_count:
+            max_count, mode = counts[measure], measure
+    return mode
+
+
+def simulate(header, records, args):
+    replay = Replay(header, records, args.calibration, args.scale_zero)
+    steps_per_loop = 15 * DEGREE_STEPS
+    pullback_steps = args.pullback_degrees * DEGREE_STEPS
+    scale_frequency = 90 * DEGREE_STEPS
+    pullback_frequency = 180 * DEGREE_STEPS
+
+    starting_weight = accurate_weight(replay, args.measures)
+    dosis = last_dosis = steps_count = clog_times = 0
+    clogged = pull_back = False
+    passes = 0
+
+    def end_feed():
+        replay.step(pullback_steps * 2, True)
+        return starting_weight - accurate_weight(replay, args.measures)
+
+    while True:
+        passes += 1
+        if replay.done:
+            print("trace ran out")
+            last_dosis = end_feed()
+            break
+        if pull_back:
+            replay.step(pullback_steps, True)
+            replay.step(pullback_steps, False)
+            pull_back = False
+            if abs(dosis - last_dosis) <= args.error_range:
+                clog_times += 1
+                if clog_times >= args.clog_tolerance:
+                    clogged = True
+                    last_dosis = end_feed()
+                    break
+            else:
+                clog_times = 0
+            continue
+        replay.step(steps_per_loop, False)
+        steps_count += steps_per_loop
+        if steps_count % scale_frequency == 0:
+            running_weight = accurate_weight(replay, args.measures)
+        else:
+            running_weight = replay.get_weight()
+        dosis = starting_weight - running_weight
+        if args.verbose:
+            print("steps=%d weight=%d dosis=%d" % (steps_count, running_weight, dosis))
+        if dosis >= args.amount:
+            dosis = starting_weight - accurate_weight(replay, args.measures)
+            if dosis >= args.amount:
+                last_dosis = end_feed()
+                break
+        if steps_count % pullback_frequency == 0:
+            pull_back = True
+
+    print("start=%dg last_dosis=%dg clogged=%s steps=%d passes=%d"
+          % (starting_weight, last_dosis, clogged, steps_count, passes))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("trace")
+    parser.add_argument("--dump", action="store_true", help="print the records as CSV")
+    parser.add_argument("--amount", type=int, default=25, help="dosage in g")
+    parser.add_argument("--measures", type=int, default=10, help="ACCURATE_WEIGHT_MEASURES")
+    parser.add_argument("--error-range", type=int, default=1, help="scale_error_range in g")
+    parser.add_argument("--clog-tolerance", type=int, default=3)
+    parser.add_argument("--pullback-degrees", type=int, default=90)
+    parser.add_argument("--calibration", type=int, help="override the trace calibration")
+    parser.add_argument("--scale-zero", type=int, help="override the trace scale zero")
+    parser.add_argument("-v", "--verbose", action="store_true")
+    args = parser.parse_args()
+
+    if args.calibration is not None and args.calibration < CALIB_MIN:
+        parser.error("--calibration must be at least %d" % CALIB_MIN)
+    header, records = load(args.trace)
+    if args.dump:
+        dump(header, records)
+    else:
+        simulate(header, records, args)
+
+
+if __name__ == "__main__":
+    main()
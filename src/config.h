@@ -17,4 +17,7 @@
 
 #define MQTT_HASS_STATUS_TOPIC String("homeassistant/status")
 #define MQTT_OFFLINE "offline"
-#define MQTT_ONLINE "online"
\ No newline at end of file
+#define MQTT_ONLINE "online"
+
+// Local API config
+#define API_TOKEN "" // Leave empty to disable auth on the local HTTP/WebSocket API
@@ -1,12 +1,17 @@
 #include <config.h>
 #include <ESP8266WiFi.h>
 #include <EEPROM.h>
+#include <LittleFS.h>
 #include <NTPClient.h>
 #include <WiFiUdp.h>
 #include <HX711.h>
 #include <PubSubClient.h>
 #include <ArduinoJson.h>
+#include <ESPAsyncTCP.h>
+#include <ESPAsyncWebServer.h>
+#include <algorithm>
 #include <map>
+#include <vector>
 
 #define HW_VERSION 2.0
 #define VERSION 2.1
@@ -17,7 +22,12 @@
 // Stepper Constants
 #define STEPS 3200
 #define STEP_DEFAULT_DELAY 1500
+#ifdef POWER_SAVE_MODE
+// D0 (GPIO16) has to be wired to RST to wake from deep sleep
+#define DIR_PIN D5
+#else
 #define DIR_PIN D0
+#endif
 #define STEP_PIN D1
 #define STEPPER_ENABLE_PIN D2
 #define M1 D6
@@ -27,9 +37,12 @@
 #define STEPPER_DISABLED HIGH
 #define CLOCKWISE HIGH
 #define COUNTER_CLOCKWISE LOW
+#define MOTOR_MAX_RUN_DEFAULT 20 // s, max energised time before a cooldown
+#define MOTOR_COOLDOWN_DEFAULT 10 // s, driver off time that resets the run time
+#define MOTOR_COOLDOWN_STATUS "Motor cooling down"
 
 // EEPROM Constants
-#define EEPROM_SIZE 48
+#define EEPROM_SIZE 60
 #define FREQ_HOURS_ADDR 0
 #define REVS_ADDR 4
 #define FEED_START_HOUR_ADDR 8
@@ -42,6 +55,15 @@
 #define PULLBACK_STEPS_ADDR 36
 #define WEIGHT_BASED_ADDR 40
 #define SPEED_ADDR 44
+#define SCALE_CALIBRATION_ADDR 48
+#define MOTOR_MAX_RUN_ADDR 52
+#define MOTOR_COOLDOWN_ADDR 56
+
+// Power Save Constants
+#define POWER_SAVE_CHECKIN_INTERVAL 900000 // 15min
+#define POWER_SAVE_LISTEN_WINDOW 1000
+#define RTC_STATE_MAGIC 0xCAFEF00D
+#define QUEUE_SPILL_FILE "/queue.txt"
 
 // Time Constants
 #define TIME_UPDATE_INTERVAL 60000
@@ -51,15 +73,44 @@
 // Scale Constants
 #define SCALE_DAT_PIN D3
 #define SCALE_CLK_PIN D4
-#define SCALE_CALIB_FACTOR 466300.0
+#define SCALE_CALIB_FACTOR 466300 // raw counts per kg
+#define SCALE_Q_BITS 24
+#define SCALE_CALIB_MIN 1000 // keeps the Q8.24 factor inside int32
 #define ACCURATE_WEIGHT_MEASURES 10
 
+// Scale Trace Constants
+#define TRACE_FILE "/trace.bin"
+#define TRACE_MAGIC "CFT1"
+#define TRACE_VERSION 1
+#define TRACE_MAX_SIZE 65536
+#define TRACE_CHUNK_SIZE 256
+#define TRACE_SAMPLE 0
+#define TRACE_PUSH 1
+#define TRACE_PULL 2
+
 
 // MQTT Constants
-#define MQTT_MAX_PACKET_SIZE 512
+#define MQTT_MAX_PACKET_SIZE 640
 #define MQTT_PERIODIC_UPDATE_INTERVAL 2000
 #define MQTT_DISCOVERY_REMINDER_FREQUENCY 30000 // 30s
 #define MQTT_CONNECT_TIMEOUT 2000
+#define MQTT_RECONNECT_INTERVAL 10000
+#define MQTT_CMD_QOS 1
+#ifdef POWER_SAVE_MODE
+// Keep the session while asleep so the broker holds QoS 1 commands sent
+// in between until the next wake
+#define MQTT_CLEAN_SESSION false
+#else
+#define MQTT_CLEAN_SESSION true
+#endif
+#define PUBLISH_QUEUE_SIZE 16
+
+// Local API Constants
+#define HTTP_PORT 80
+#define WS_PATH "/ws"
+#define LOCAL_CMD_QUEUE_SIZE 8
+#define WS_WEIGHT_INTERVAL 100
+#define WS_SAMPLE_STEPS 16
 
 // LOGGING
 #define LOG_MAX_STRING_SIZE 2000
@@ -92,6 +143,17 @@ int stepDelay = STEP_DEFAULT_DELAY;
 int stepsCount = 0;
 boolean isPullBack = false;
 
+// Motor duty cycle
+boolean isMotorOn = false;
+boolean isCoolingDown = false;
+unsigned long motorOnAt = 0;
+unsigned long motorOffAt = 0;
+unsigned long runEnergisedMs = 0;
+unsigned long feedEnergisedMs = 0;
+int motorCooldowns = 0;
+int motorMaxRun = MOTOR_MAX_RUN_DEFAULT;
+int motorCooldown = MOTOR_COOLDOWN_DEFAULT;
+
 int clog_tolerance = 3;
 
 // Weight based dosage
@@ -117,29 +179,154 @@ NTPClient timeClient(ntpUDP, "europe.pool.ntp.org", UTC_OFFSET_SEC);
 
 // Scale config
 HX711 scale;
-float scale_calibration = 466300.0;
+int scale_calibration = SCALE_CALIB_FACTOR;
+// grams per raw count in Q8.24, precomputed so getWeight() avoids float
+int32_t scale_q = ((int64_t)1000 << SCALE_Q_BITS)/SCALE_CALIB_FACTOR;
 int scale_zero = -288;
 int scale_error_range = 1;
 
 // MQTT Config
 const String mqttName = "Cat Feeder";
-const String stateTopic = "home/cat_feeder/state";
-const String availabilityTopic = "home/cat_feeder/available";
-const String dosageCmdTopic = "home/cat_feeder/dosage";
-const String runningCmdTopic = "home/cat_feeder/running";
-const String weightBasedCmdTopic = "home/cat_feeder/weight_based";
-const String flowCmdTopic = "home/cat_feeder/flow";
-const String scaleZeroCmdTopic = "home/cat_feeder/scale_zero";
-const String clogToleranceCmdTopic = "home/cat_feeder/clog_tolerance";
-const String pullbackDegreesCmdTopic = "home/cat_feeder/pullback_degrees";
-const String speedCmdTopic = "home/cat_feeder/speed";
+const String baseTopic = "home/cat_feeder/";
+const String stateTopic = baseTopic + "state";
+const String availabilityTopic = baseTopic + "available";
+const String dosageCmdTopic = baseTopic + "dosage";
+const String runningCmdTopic = baseTopic + "running";
+const String weightBasedCmdTopic = baseTopic + "weight_based";
+const String flowCmdTopic = baseTopic + "flow";
+const String scaleZeroCmdTopic = baseTopic + "scale_zero";
+const String clogToleranceCmdTopic = baseTopic + "clog_tolerance";
+const String pullbackDegreesCmdTopic = baseTopic + "pullback_degrees";
+const String speedCmdTopic = baseTopic + "speed";
+const String feedIntervalCmdTopic = baseTopic + "feed_interval";
+const String motorMaxRunCmdTopic = baseTopic + "motor_max_run";
+const String motorCooldownCmdTopic = baseTopic + "motor_cooldown";
+const String scaleCalibrationCmdTopic = baseTopic + "scale_calibration";
+const String eventTopic = baseTopic + "event";
+const String traceCaptureCmdTopic = baseTopic + "trace/capture";
+const String traceDownloadCmdTopic = baseTopic + "trace/download";
+const String traceReplayCmdTopic = baseTopic + "trace/replay";
+const String traceInfoTopic = baseTopic + "trace/info";
+const String traceDataTopic = baseTopic + "trace/data";
+const String replayStateTopic = baseTopic + "trace/replay/state";
+const String replayEventTopic = baseTopic + "trace/replay/event";
 
 unsigned long lastMqttUpdateTime = 0;
 unsigned long lastMqttDiscovery = 0;
+unsigned long lastMqttConnectAttempt = 0;
 WiFiClient wifiClient;
 PubSubClient client(wifiClient);
 DynamicJsonDocument deviceInfo(1024);
 
+// Local API config
+AsyncWebServer server(HTTP_PORT);
+AsyncWebSocket ws(WS_PATH);
+// Commands from the local API are queued here and run from loop(), since
+// async callbacks can't block (feed() and the scale reads call delay()).
+std::vector<std::pair<String, String>> pendingCommands;
+// Websocket clients that sent API_TOKEN, the only ones getting pushes
+std::vector<uint32_t> wsAuthedClients;
+String lastStatusJson = "{}";
+unsigned long lastWsWeightAt = 0;
+
+// Offline publish queue
+// Events are kept in order in a ring, dropping the oldest when full. Only the
+// latest state snapshot is kept, as it supersedes any older one, and it is
+// published after the queued events.
+struct QueuedMessage {
+  String topic;
+  String payload;
+};
+
+QueuedMessage publishQueue[PUBLISH_QUEUE_SIZE];
+int publishQueueHead = 0;
+int publishQueueCount = 0;
+unsigned long publishQueueDrops = 0;
+uint32_t eventSeq = 0;
+// ms spent in earlier wake cycles, so event times keep counting across sleep
+uint32_t uptimeOffsetMs = 0;
+String pendingState = "";
+
+// Power save
+// Runtime state kept in RTC memory across deep sleep, so a timer wake doesn't
+// have to re-read EEPROM or resend the discovery messages.
+struct RtcState {
+  uint32_t crc;
+  uint32_t magic;
+  int hoursFrequency;
+  float numberOfRevolutions;
+  int amount;
+  int flow;
+  int scaleZero;
+  int clogTolerance;
+  int scaleErrorRange;
+  int pullbackSteps;
+  int32_t isWeightBased;
+  int speed;
+  int motorMaxRun;
+  int motorCooldown;
+  int scaleCalibration;
+  int lastDosis;
+  uint32_t feedDueInMs;
+  uint32_t sleepMs;
+  uint32_t awakeMs;
+  uint32_t wakeCount;
+  uint32_t eventSeq;
+  uint32_t uptimeMs;
+  int32_t isClogged;
+  uint32_t feedEnergisedMs;
+  int motorCooldowns;
+  uint32_t publishQueueDrops;
+  char status[48];
+};
+
+boolean isWarmWake = false;
+uint32_t feedDueInMs = 0;
+uint32_t lastSleepMs = 0;
+uint32_t lastAwakeMs = 0;
+uint32_t wakeCount = 0;
+
+// Scale trace
+// File layout: TraceHeader followed by TraceRecords. Each record carries the
+// ms elapsed since the previous one and either a raw HX711 count
+// (TRACE_SAMPLE) or the number of steps of a push/pull move.
+// scripts/trace_replay.py decodes it and runs a hand kept Python model of
+// the dosing logic over it, to be updated along with that logic.
+struct TraceHeader {
+  char magic[4];
+  uint16_t version;
+  uint16_t recordSize;
+  int32_t calibration;
+  int32_t scaleZero;
+};
+
+struct TraceRecord {
+  uint8_t type;
+  uint8_t reserved;
+  uint16_t deltaMs;
+  int32_t value;
+};
+
+boolean isTraceCapture = false;
+boolean isReplaying = false;
+boolean isReplayDone = false;
+long replaySample = 0;
+// Auger position (pushed minus pulled steps) of the replayed feed and of
+// the trace cursor, used to keep the samples in line with the auger.
+long replayLivePosition = 0;
+long replayTracePosition = 0;
+TraceRecord replayRecord;
+boolean hasReplayRecord = false;
+int32_t replayScaleQ = 0;
+int replayScaleZero = 0;
+// Results of the last real feed, put back once a replay finishes
+int savedLastDosis = 0;
+boolean savedIsClogged = false;
+unsigned long savedFeedEnergisedMs = 0;
+int savedMotorCooldowns = 0;
+File traceFile;
+unsigned long lastTraceMillis = 0;
+
 String status = "";
 
 void setupMqtt(); // Forward declaration
@@ -162,23 +349,217 @@ String twoDigit(int val) {
   return out;
 }
 
+int32_t calibrationToQ(int calibration) {
+  return ((int64_t)1000 << SCALE_Q_BITS)/calibration;
+}
+
+void updateScaleQ() {
+  scale_q = calibrationToQ(scale_calibration);
+}
+
+int rawToGrams(long raw, int32_t q) {
+  return (int)(((int64_t)raw*q + (1 << (SCALE_Q_BITS-1))) >> SCALE_Q_BITS);
+}
+
+void writeTraceRecord(uint8_t type, int32_t value) {
+  if (!traceFile || isReplaying || traceFile.size() + sizeof(TraceRecord) > TRACE_MAX_SIZE) {
+    return;
+  }
+  unsigned long now = millis();
+  TraceRecord record;
+  record.type = type;
+  record.reserved = 0;
+  record.deltaMs = (uint16_t)min(now-lastTraceMillis, 65535UL);
+  record.value = value;
+  lastTraceMillis = now;
+  traceFile.write((const uint8_t*)&record, sizeof(record));
+}
+
+void startTrace() {
+  if (!isTraceCapture || isReplaying) {
+    return;
+  }
+  traceFile = LittleFS.open(TRACE_FILE, "w");
+  if (!traceFile) {
+    log("Failed to open trace file");
+    return;
+  }
+  TraceHeader header;
+  memcpy(header.magic, TRACE_MAGIC, 4);
+  header.version = TRACE_VERSION;
+  header.recordSize = sizeof(TraceRecord);
+  header.calibration = scale_calibration;
+  header.scaleZero = scale_zero;
+  traceFile.write((const uint8_t*)&header, sizeof(header));
+  lastTraceMillis = millis();
+  log("Trace capture started");
+}
+
+void stopTrace() {
+  if (traceFile && !isReplaying) {
+    log("Trace capture stopped at " + String(traceFile.size()) + " bytes");
+    traceFile.close();
+  }
+}
+
+void stopReplay() {
+  if (isReplaying) {
+    log("Trace replay finished");
+    traceFile.close();
+    isReplaying = false;
+    lastDosis = savedLastDosis;
+    isClogged = savedIsClogged;
+    feedEnergisedMs = savedFeedEnergisedMs;
+    motorCooldowns = savedMotorCooldowns;
+  }
+}
+
+void startReplay() {
+  stopTrace();
+  traceFile = LittleFS.open(TRACE_FILE, "r");
+  TraceHeader header;
+  if (!traceFile || traceFile.read((uint8_t*)&header, sizeof(header)) != sizeof(header)
+      || memcmp(header.magic, TRACE_MAGIC, 4) != 0 || header.recordSize != sizeof(TraceRecord)
+      || header.calibration < SCALE_CALIB_MIN) {
+    log("No valid trace to replay");
+    if (traceFile) {
+      traceFile.close();
+    }
+    return;
+  }
+  savedLastDosis = lastDosis;
+  savedIsClogged = isClogged;
+  savedFeedEnergisedMs = feedEnergisedMs;
+  savedMotorCooldowns = motorCooldowns;
+  isReplaying = true;
+  isReplayDone = false;
+  replaySample = 0;
+  replayLivePosition = 0;
+  replayTracePosition = 0;
+  hasReplayRecord = false;
+  replayScaleQ = calibrationToQ(header.calibration);
+  replayScaleZero = header.scaleZero;
+  log("Trace replay started");
+}
+
+boolean peekReplayRecord() {
+  if (!hasReplayRecord) {
+    hasReplayRecord = traceFile.read((uint8_t*)&replayRecord, sizeof(replayRecord)) == sizeof(replayRecord);
+  }
+  return hasReplayRecord;
+}
+
+// Next raw count recorded at the current auger position. Samples never
+// cross a step marker: once the ones taken at this position are used up the
+// last count is repeated until doStep() moves the cursor on.
+long readReplaySample() {
+  if (peekReplayRecord() && replayRecord.type == TRACE_SAMPLE) {
+    replaySample = replayRecord.value;
+    hasReplayRecord = false;
+  }
+  return replaySample;
+}
+
+// Moves the trace cursor up to the auger position of the replayed feed.
+// When the trace runs out the replay is flagged as done, so loop() ends the
+// feed instead of reading the real scale.
+void advanceReplay(bool clockwise, int steps) {
+  replayLivePosition += clockwise ? -steps : steps;
+  while (replayTracePosition < replayLivePosition) {
+    if (!peekReplayRecord()) {
+      isReplayDone = true;
+      return;
+    }
+    if (replayRecord.type == TRACE_SAMPLE) {
+      replaySample = replayRecord.value;
+    } else {
+      replayTracePosition += replayRecord.type == TRACE_PULL ? -replayRecord.value : replayRecord.value;
+    }
+    hasReplayRecord = false;
+  }
+}
+
+void sendTrace() {
+  if (traceFile) {
+    log("Trace file busy");
+    return;
+  }
+  File file = LittleFS.open(TRACE_FILE, "r");
+  if (!file) {
+    client.publish(traceInfoTopic.c_str(), "{\"size\":0}");
+    return;
+  }
+  size_t size = file.size();
+  String info = "{\"size\":" + String(size) + ",\"chunk\":" + String(TRACE_CHUNK_SIZE) + "}";
+  client.publish(traceInfoTopic.c_str(), info.c_str());
+  uint8_t buffer[TRACE_CHUNK_SIZE];
+  while (file.available()) {
+    size_t n = file.read(buffer, TRACE_CHUNK_SIZE);
+    if (!client.publish(traceDataTopic.c_str(), buffer, n)) {
+      log("Failed to send trace chunk");
+      break;
+    }
+    client.loop();
+  }
+  file.close();
+}
+
+long readScaleRaw() {
+  long raw = scale.read();
+  writeTraceRecord(TRACE_SAMPLE, raw);
+  return raw;
+}
+
 int getWeight() {
-  return (int)(scale.get_units()*1000)-scale_zero;
+  if (isReplaying) {
+    // Trace counts go through the calibration they were recorded with
+    return rawToGrams(readReplaySample(), replayScaleQ)-replayScaleZero;
+  }
+  return rawToGrams(readScaleRaw(), scale_q)-scale_zero;
   // return 0;
 }
 
+void wsTextAuthed(const char *buffer, size_t n) {
+  for (uint32_t id : wsAuthedClients) {
+    ws.text(id, buffer, n);
+  }
+}
+
+void pushWsWeight(int weight) {
+  if (wsAuthedClients.empty() || isReplaying) {
+    return;
+  }
+  char buffer[32];
+  int n = snprintf(buffer, sizeof(buffer), "{\"weight\":%d}", weight);
+  wsTextAuthed(buffer, n);
+  lastWsWeightAt = millis();
+}
+
+// Pushes a weight reading to the websocket clients at WS_WEIGHT_INTERVAL
+// without waiting on the scale. Reads the HX711 directly so the extra
+// samples don't end up in a trace capture.
+void sampleWsWeight() {
+  if (wsAuthedClients.empty() || isReplaying || millis()-lastWsWeightAt < WS_WEIGHT_INTERVAL || !scale.is_ready()) {
+    return;
+  }
+  pushWsWeight(rawToGrams(scale.read(), scale_q)-scale_zero);
+}
+
 int getAccurateWeight() {
   int maxCount = 0;
   int mode = 0;
   std::map<int,int> measures;
   for (int i=0;i<ACCURATE_WEIGHT_MEASURES;i++) {
       int measure = getWeight();
+      pushWsWeight(measure);
       measures[measure]++;
       if (measures[measure] > maxCount) {
         maxCount = measures[measure];
         mode = measure;
       }
-      delay(100);
+      if (!isReplaying) {
+        delay(100);
+      }
   }
   return mode;
 }
@@ -200,6 +581,7 @@ DynamicJsonDocument buildDiscoveryStub(String name, String id) {
   doc["stat_t"] = stateTopic;
   doc["device"] = deviceInfo;
   doc["avty_t"] = availabilityTopic;
+  doc["qos"] = MQTT_CMD_QOS;
   return doc;
 }
 
@@ -331,6 +713,57 @@ void sendMQTTSpeedDiscoveryMessage() {
   sendMQTTDiscoveryMessage(discoveryTopic, doc);
 }
 
+void sendMQTTFeedIntervalDiscoveryMessage() {
+  String discoveryTopic = "homeassistant/number/cat_feeder/feed_interval/config";
+  DynamicJsonDocument doc = buildDiscoveryStub("CF Feed Interval", "cf_feed_interval");
+  doc["icon"] = "mdi:timer-sync-outline";
+  doc["cmd_t"] = feedIntervalCmdTopic;
+  doc["min"] = 0;
+  doc["max"] = 168;
+  doc["unit_of_meas"] = "h";
+  doc["mode"] = "box";
+  doc["val_tpl"] = "{{ value_json.feed_interval|default(0) }}";
+  sendMQTTDiscoveryMessage(discoveryTopic, doc);
+}
+
+void sendMQTTMotorMaxRunDiscoveryMessage() {
+  String discoveryTopic = "homeassistant/number/cat_feeder/motor_max_run/config";
+  DynamicJsonDocument doc = buildDiscoveryStub("CF Motor Max Run", "cf_motor_max_run");
+  doc["icon"] = "mdi:timer-outline";
+  doc["cmd_t"] = motorMaxRunCmdTopic;
+  doc["min"] = 1;
+  doc["max"] = 600;
+  doc["unit_of_meas"] = "s";
+  doc["mode"] = "box";
+  doc["val_tpl"] = "{{ value_json.motor_max_run|default(20) }}";
+  sendMQTTDiscoveryMessage(discoveryTopic, doc);
+}
+
+void sendMQTTMotorCooldownDiscoveryMessage() {
+  String discoveryTopic = "homeassistant/number/cat_feeder/motor_cooldown/config";
+  DynamicJsonDocument doc = buildDiscoveryStub("CF Motor Cooldown", "cf_motor_cooldown");
+  doc["icon"] = "mdi:snowflake-thermometer";
+  doc["cmd_t"] = motorCooldownCmdTopic;
+  doc["min"] = 1;
+  doc["max"] = 600;
+  doc["unit_of_meas"] = "s";
+  doc["mode"] = "box";
+  doc["val_tpl"] = "{{ value_json.motor_cooldown|default(10) }}";
+  sendMQTTDiscoveryMessage(discoveryTopic, doc);
+}
+
+void sendMQTTScaleCalibrationDiscoveryMessage() {
+  String discoveryTopic = "homeassistant/number/cat_feeder/scale_calibration/config";
+  DynamicJsonDocument doc = buildDiscoveryStub("CF Scale Calibration", "cf_scale_calibration");
+  doc["icon"] = "mdi:scale-balance";
+  doc["cmd_t"] = scaleCalibrationCmdTopic;
+  doc["min"] = SCALE_CALIB_MIN;
+  doc["max"] = 10000000;
+  doc["mode"] = "box";
+  doc["val_tpl"] = "{{ value_json.scale_calibration|default(0) }}";
+  sendMQTTDiscoveryMessage(discoveryTopic, doc);
+}
+
 void sendMQTTErrorDiscoveryMessage() {
   String discoveryTopic = "homeassistant/sensor/cat_feeder/status/config";
   DynamicJsonDocument doc = buildDiscoveryStub("CF status msg", "cf_status");
@@ -339,10 +772,7 @@ void sendMQTTErrorDiscoveryMessage() {
   sendMQTTDiscoveryMessage(discoveryTopic, doc);
 }
 
-boolean sendMqttStatus(float weight) {
-  DynamicJsonDocument doc(1024);
-  char buffer[256];
-
+void buildStatus(DynamicJsonDocument &doc, int weight) {
   doc["weight"] = weight;
   doc["dosage"] = amount;
   doc["running"] = isRunning;
@@ -354,17 +784,118 @@ boolean sendMqttStatus(float weight) {
   doc["pullback_degrees"] = pullbackSteps/degreeSteps;
   doc["last_dosis"] = lastDosis;
   doc["speed"] = speed;
+  doc["feed_interval"] = hoursFrequency;
+  doc["scale_calibration"] = scale_calibration;
+  doc["queue_depth"] = publishQueueCount;
+  doc["queue_drops"] = publishQueueDrops;
+  doc["motor_on_ms"] = feedEnergisedMs;
+  doc["motor_cooldowns"] = motorCooldowns;
+  doc["motor_max_run"] = motorMaxRun;
+  doc["motor_cooldown"] = motorCooldown;
+#ifdef POWER_SAVE_MODE
+  doc["awake_ms"] = lastAwakeMs;
+#endif
   doc["status"] = status;
+}
 
-  size_t n = serializeJson(doc, buffer);
-  String message;
-  serializeJson(doc, message);
+void broadcastStatus(const char *buffer, size_t n) {
+  lastStatusJson = String(buffer);
+  wsTextAuthed(buffer, n);
+}
+
+void queueMessage(String topic, String payload) {
+  if (publishQueueCount == PUBLISH_QUEUE_SIZE) {
+    publishQueueHead = (publishQueueHead+1)%PUBLISH_QUEUE_SIZE;
+    publishQueueCount--;
+    publishQueueDrops++;
+  }
+  QueuedMessage &slot = publishQueue[(publishQueueHead+publishQueueCount)%PUBLISH_QUEUE_SIZE];
+  slot.topic = topic;
+  slot.payload = payload;
+  publishQueueCount++;
+}
+
+boolean flushPublishQueue() {
+  if (!client.connected()) {
+    return false;
+  }
+  if (publishQueueCount > 0 || pendingState != "") {
+    log("Flushing " + String(publishQueueCount) + " queued messages");
+  }
+  while (publishQueueCount > 0) {
+    QueuedMessage &msg = publishQueue[publishQueueHead];
+    if (!client.publish(msg.topic.c_str(), msg.payload.c_str())) {
+      return false;
+    }
+    msg.topic = "";
+    msg.payload = "";
+    publishQueueHead = (publishQueueHead+1)%PUBLISH_QUEUE_SIZE;
+    publishQueueCount--;
+  }
+  if (pendingState != "") {
+    if (!client.publish(stateTopic.c_str(), pendingState.c_str(), true)) {
+      return false;
+    }
+    pendingState = "";
+  }
+  return true;
+}
 
-  boolean sent = client.publish(stateTopic.c_str(), buffer, n);
+// Publishes right away when possible, otherwise queues the message so it
+// goes out in order once the connection is back. State is retained, as it
+// always was, so Home Assistant has it after a restart; events are not.
+boolean publishOrQueue(String topic, const char *payload, boolean isState) {
+  if (flushPublishQueue() && client.publish(topic.c_str(), payload, isState)) {
+    return true;
+  }
+  if (isState) {
+    pendingState = payload;
+  } else {
+    queueMessage(topic, payload);
+  }
+  return false;
+}
+
+// Replayed feeds publish on their own topics, tagged, and are never queued,
+// so Home Assistant doesn't record them as real feeds.
+void sendMqttEvent(DynamicJsonDocument &doc) {
+  char buffer[256];
+  // Queued events go out in a burst after an outage, so each one carries
+  // when it happened and a sequence number to spot gaps and duplicates.
+  doc["seq"] = ++eventSeq;
+  doc["ms"] = uptimeOffsetMs+millis();
+  if (isReplaying) {
+    doc["replay"] = true;
+    serializeJson(doc, buffer);
+    client.publish(replayEventTopic.c_str(), buffer);
+    return;
+  }
+  serializeJson(doc, buffer);
+  if (!publishOrQueue(eventTopic, buffer, false)) {
+    log("Mqtt event queued");
+  }
+}
+
+boolean sendMqttStatus(int weight) {
+  DynamicJsonDocument doc(1024);
+  char buffer[512];
+
+  buildStatus(doc, weight);
+  boolean sent;
+  if (isReplaying) {
+    doc["replay"] = true;
+    size_t n = serializeJson(doc, buffer);
+    wsTextAuthed(buffer, n);
+    sent = client.publish(replayStateTopic.c_str(), buffer);
+  } else {
+    size_t n = serializeJson(doc, buffer);
+    broadcastStatus(buffer, n);
+    sent = publishOrQueue(stateTopic, buffer, true);
+  }
   if (sent) {
     log("Mqtt Status Sent");
   } else {
-    log("Failed to send mqtt status!!");
+    log("Failed to send mqtt status, queued");
   }
   lastMqttUpdateTime = millis();
   return sent;
@@ -374,18 +905,58 @@ boolean sendMqttStatus() {
   return sendMqttStatus(getAccurateWeight());
 }
 
+// The auger holds the food without torque, so the driver is only energised
+// while stepping. Run time adds up until it has been off for a cooldown.
+void motorOn() {
+  if (isMotorOn) {
+    return;
+  }
+  unsigned long now = millis();
+  if (now-motorOffAt >= (unsigned long)motorCooldown*1000) {
+    runEnergisedMs = 0;
+  }
+  digitalWrite(STEPPER_ENABLE_PIN, STEPPER_ENABLED);
+  motorOnAt = now;
+  isMotorOn = true;
+}
+
+void motorOff() {
+  if (!isMotorOn) {
+    return;
+  }
+  digitalWrite(STEPPER_ENABLE_PIN, STEPPER_DISABLED);
+  motorOffAt = millis();
+  runEnergisedMs += motorOffAt-motorOnAt;
+  feedEnergisedMs += motorOffAt-motorOnAt;
+  isMotorOn = false;
+}
+
+boolean isMotorCoolingDown() {
+  return runEnergisedMs >= (unsigned long)motorMaxRun*1000 && millis()-motorOffAt < (unsigned long)motorCooldown*1000;
+}
+
 void doStep(int steps, bool clockwise) {
+  writeTraceRecord(clockwise ? TRACE_PULL : TRACE_PUSH, steps);
+  if (isReplaying) {
+    advanceReplay(clockwise, steps);
+    return;
+  }
+  motorOn();
   if (clockwise) {
     digitalWrite(DIR_PIN, CLOCKWISE);
   } else {
     digitalWrite(DIR_PIN, COUNTER_CLOCKWISE);
   }
   for (int x = 0; x < steps * 1; x++) {
+      if (x % WS_SAMPLE_STEPS == 0) {
+        sampleWsWeight();
+      }
       digitalWrite(STEP_PIN, HIGH);
       delayMicroseconds(stepDelay);
       digitalWrite(STEP_PIN, LOW);
       delayMicroseconds(stepDelay);
    }
+  motorOff();
 }
 
 void push(int steps) {
@@ -401,18 +972,33 @@ void endFeed() {
   log("Stop turning at steps: " + String(stepsCount));
   isRunning = false;
   lastDosis = startingWeight-getAccurateWeight();
+  stopTrace();
+
+  DynamicJsonDocument event(256);
+  event["event"] = "feed_end";
+  event["last_dosis"] = lastDosis;
+  event["clogged"] = isClogged;
+  event["steps"] = stepsCount;
+  event["motor_on_ms"] = feedEnergisedMs;
+  event["motor_cooldowns"] = motorCooldowns;
+  sendMqttEvent(event);
   sendMqttStatus();
+  stopReplay();
 }
 
 void feed() {
   log("Requested feed");
   if (!isRunning) {
     log("Starting feed");
+    startTrace();
     startingWeight = getAccurateWeight();
     runningWeight = startingWeight;
     dosis = 0;
     lastDosis = 0;
     stepsCount = 0;
+    feedEnergisedMs = 0;
+    motorCooldowns = 0;
+    isCoolingDown = false;
     lastHourRun = hours;
     lastMinutesRun = minutes;
     isRunning = true;
@@ -466,33 +1052,60 @@ void storePullbackDegrees(int degrees) {
   }
 }
 
+void storeFeedInterval(int val) {
+  if (val >= 0 && val != hoursFrequency) {
+    hoursFrequency = val;
+    EEPROM.put(FREQ_HOURS_ADDR, hoursFrequency);
+    // Restart the countdown from now with the new interval
+    feedDueInMs = (uint32_t)hoursFrequency*3600000+millis();
+  }
+}
+
 void storeSpeed(int val) {
-  if (val != speed) {
+  if (val > 0 && val != speed) {
     speed = val;
     EEPROM.put(SPEED_ADDR, speed);
     stepDelay = STEP_DEFAULT_DELAY/speed*10;
   }
 }
 
+void storeMotorMaxRun(int val) {
+  if (val > 0 && val != motorMaxRun) {
+    motorMaxRun = val;
+    EEPROM.put(MOTOR_MAX_RUN_ADDR, motorMaxRun);
+  }
+}
+
+void storeMotorCooldown(int val) {
+  if (val > 0 && val != motorCooldown) {
+    motorCooldown = val;
+    EEPROM.put(MOTOR_COOLDOWN_ADDR, motorCooldown);
+  }
+}
+
+void storeScaleCalibration(int val) {
+  if (val >= SCALE_CALIB_MIN && val != scale_calibration) {
+    scale_calibration = val;
+    EEPROM.put(SCALE_CALIBRATION_ADDR, scale_calibration);
+    updateScaleQ();
+  }
+}
+
 void handleHassStatusChange(String message) {
   if (message == MQTT_ONLINE) {
       setupMqtt();
   }
 }
 
-void mqttCallback(char *topic, byte *payload, unsigned int length){
-  log("Message arrived in topic: " + String(topic));
-  String message;
-  for (int i = 0; i < length; i++) {
-      message = message + (char) payload[i];  // convert *byte to string
-  }
-  log("Message: "+ message);
+void handleCommand(String topic, String message) {
   EEPROM.begin(EEPROM_SIZE);
   if (runningCmdTopic == topic) {
     if (message == "True") {
       feed();
-    } else {
+    } else if (isRunning) {
       endFeed();
+    } else {
+      sendMqttStatus();
     }
   } else if (dosageCmdTopic == topic) {
     storeAmount(message.toInt());
@@ -515,14 +1128,174 @@ void mqttCallback(char *topic, byte *payload, unsigned int length){
   } else if (speedCmdTopic == topic) {
     storeSpeed(message.toInt());
     sendMqttStatus();
+  } else if (feedIntervalCmdTopic == topic) {
+    storeFeedInterval(message.toInt());
+    sendMqttStatus();
+  } else if (motorMaxRunCmdTopic == topic) {
+    storeMotorMaxRun(message.toInt());
+    sendMqttStatus();
+  } else if (motorCooldownCmdTopic == topic) {
+    storeMotorCooldown(message.toInt());
+    sendMqttStatus();
+  } else if (scaleCalibrationCmdTopic == topic) {
+    storeScaleCalibration(message.toInt());
+    sendMqttStatus();
+  } else if (traceCaptureCmdTopic == topic) {
+    isTraceCapture = message == "True";
+  } else if (traceDownloadCmdTopic == topic) {
+    sendTrace();
+  } else if (traceReplayCmdTopic == topic) {
+    if (message != "True") {
+      if (isRunning) {
+        // Never hand a running feed over to the real auger
+        isReplayDone = true;
+      } else {
+        stopReplay();
+      }
+    } else if (!isRunning) {
+      // The replay runs its own feed straight away, so trace samples are
+      // never used up by idle status updates before the feed starts.
+      startReplay();
+      if (isReplaying) {
+        feed();
+      }
+    }
   } else if (MQTT_HASS_STATUS_TOPIC == topic) {
     handleHassStatusChange(message);
   } else {
-    log("Invalid topic: " + String(topic));
+    log("Invalid topic: " + topic);
   }
   EEPROM.end();
 }
 
+void mqttCallback(char *topic, byte *payload, unsigned int length){
+  log("Message arrived in topic: " + String(topic));
+  String message;
+  for (int i = 0; i < length; i++) {
+      message = message + (char) payload[i];  // convert *byte to string
+  }
+  log("Message: "+ message);
+  handleCommand(String(topic), message);
+}
+
+boolean queueLocalCommand(String cmd, String value) {
+  if (cmd == "" || pendingCommands.size() >= LOCAL_CMD_QUEUE_SIZE) {
+    return false;
+  }
+  // Local commands use the same names as the last part of the mqtt topics
+  pendingCommands.push_back(std::make_pair(baseTopic + cmd, value));
+  return true;
+}
+
+void processLocalCommands() {
+  if (pendingCommands.empty()) {
+    return;
+  }
+  std::vector<std::pair<String, String>> commands;
+  commands.swap(pendingCommands);
+  for (auto &command : commands) {
+    log("Local command: " + command.first + " " + command.second);
+    handleCommand(command.first, command.second);
+  }
+}
+
+boolean isApiAuthorized(String token) {
+  return strlen(API_TOKEN) == 0 || token == API_TOKEN;
+}
+
+boolean isRequestAuthorized(AsyncWebServerRequest *request, bool post) {
+  return isApiAuthorized(request->hasParam("token", post) ? request->getParam("token", post)->value() : String(""));
+}
+
+boolean isWsAuthorized(uint32_t id) {
+  return std::find(wsAuthedClients.begin(), wsAuthedClients.end(), id) != wsAuthedClients.end();
+}
+
+void authorizeWsClient(AsyncWebSocketClient *wsClient) {
+  wsAuthedClients.push_back(wsClient->id());
+  wsClient->text(lastStatusJson);
+}
+
+void handleWsMessage(AsyncWebSocketClient *wsClient, void *arg, uint8_t *data, size_t len) {
+  AwsFrameInfo *info = (AwsFrameInfo*)arg;
+  if (!info->final || info->index != 0 || info->len != len || info->opcode != WS_TEXT) {
+    return;
+  }
+  // Expected payload: {"token":"...","cmd":"dosage","value":30}, the token
+  // is only needed on the first frame and a frame with just it authorizes.
+  StaticJsonDocument<256> doc;
+  if (deserializeJson(doc, data, len)) {
+    wsClient->text("{\"error\":\"invalid json\"}");
+    return;
+  }
+  if (!isWsAuthorized(wsClient->id())) {
+    if (!isApiAuthorized(doc["token"].as<String>())) {
+      wsClient->text("{\"error\":\"unauthorized\"}");
+      return;
+    }
+    authorizeWsClient(wsClient);
+  }
+  if (!doc.containsKey("cmd") && !doc.containsKey("value")) {
+    return;
+  }
+  if (!doc.containsKey("cmd") || !doc.containsKey("value")) {
+    wsClient->text("{\"error\":\"missing cmd or value\"}");
+    return;
+  }
+  String value;
+  if (doc["value"].is<bool>()) {
+    value = doc["value"].as<bool>() ? "True" : "False";
+  } else {
+    value = doc["value"].as<String>();
+  }
+  if (!queueLocalCommand(doc["cmd"].as<String>(), value)) {
+    wsClient->text("{\"error\":\"command rejected\"}");
+  }
+}
+
+void onWsEvent(AsyncWebSocket *wsServer, AsyncWebSocketClient *wsClient, AwsEventType type, void *arg, uint8_t *data, size_t len) {
+  if (type == WS_EVT_CONNECT) {
+    if (isApiAuthorized("")) {
+      authorizeWsClient(wsClient);
+    }
+  } else if (type == WS_EVT_DISCONNECT) {
+    wsAuthedClients.erase(std::remove(wsAuthedClients.begin(), wsAuthedClients.end(), wsClient->id()), wsAuthedClients.end());
+  } else if (type == WS_EVT_DATA) {
+    handleWsMessage(wsClient, arg, data, len);
+  }
+}
+
+void setupLocalApi() {
+  log("Setting up local api");
+  ws.onEvent(onWsEvent);
+  server.addHandler(&ws);
+  server.on("/state", HTTP_GET, [](AsyncWebServerRequest *request) {
+    if (!isRequestAuthorized(request, false)) {
+      request->send(401, "text/plain", "Unauthorized");
+      return;
+    }
+    request->send(200, "application/json", lastStatusJson);
+  });
+  server.on("/command", HTTP_POST, [](AsyncWebServerRequest *request) {
+    if (!isRequestAuthorized(request, true)) {
+      request->send(401, "text/plain", "Unauthorized");
+      return;
+    }
+    if (!request->hasParam("cmd", true) || !request->hasParam("value", true)) {
+      request->send(400, "text/plain", "Missing cmd or value");
+      return;
+    }
+    String cmd = request->getParam("cmd", true)->value();
+    String value = request->getParam("value", true)->value();
+    if (queueLocalCommand(cmd, value)) {
+      request->send(202, "text/plain", "Queued");
+    } else {
+      request->send(503, "text/plain", "Command rejected");
+    }
+  });
+  server.begin();
+}
+
 bool setOnline() {
   return client.publish(availabilityTopic.c_str(), MQTT_ONLINE, true);
 }
@@ -538,42 +1311,56 @@ void setupMqtt() {
   deviceInfo["identifiers"] = DEVICE_ID;
   deviceInfo["manufacturer"] = AUTHOR;
   deviceInfo["name"] = DEVICE_NAME;
-  unsigned long start = millis();
-  while (!client.connected() && millis()-start < MQTT_CONNECT_TIMEOUT) {
-    Serial.print(".");
-
-    if (client.connect(mqttName.c_str(), MQTT_USER, MQTT_PASS, availabilityTopic.c_str(), 1, true, MQTT_OFFLINE)) {
-      sendMQTTAmountDiscoveryMessage();
-      sendMQTTWeightDiscoveryMessage();
-      sendMQTTRunningDiscoveryMessage();
-      sendMQTTWeightBasedDiscoveryMessage();
-      sendMQTTCloggedDiscoveryMessage();
-      sendMQTTFlowDiscoveryMessage();
-      sendMQTTScaleZeroDiscoveryMessage();
-      sendMQTTClogToleranceDiscoveryMessage();
-      sendMQTTPullbackDegreesDiscoveryMessage();
-      sendMQTTLastDosisDiscoveryMessage();
-      sendMQTTSpeedDiscoveryMessage();
-      sendMQTTErrorDiscoveryMessage();
-      client.subscribe(dosageCmdTopic.c_str());
-      client.subscribe(runningCmdTopic.c_str());
-      client.subscribe(weightBasedCmdTopic.c_str());
-      client.subscribe(flowCmdTopic.c_str());
-      client.subscribe(scaleZeroCmdTopic.c_str());
-      client.subscribe(clogToleranceCmdTopic.c_str());
-      client.subscribe(pullbackDegreesCmdTopic.c_str());
-      client.subscribe(speedCmdTopic.c_str());
+  // A single attempt without retries: loop() calls back at most every
+  // MQTT_RECONNECT_INTERVAL so the local API keeps running while the broker
+  // is down.
+  if (!client.connected()) {
+    lastMqttConnectAttempt = millis();
+    wifiClient.setTimeout(MQTT_CONNECT_TIMEOUT);
+    if (WiFi.status() == WL_CONNECTED && client.connect(mqttName.c_str(), MQTT_USER, MQTT_PASS, availabilityTopic.c_str(), 1, true, MQTT_OFFLINE, MQTT_CLEAN_SESSION)) {
+      if (!isWarmWake) {
+        sendMQTTAmountDiscoveryMessage();
+        sendMQTTWeightDiscoveryMessage();
+        sendMQTTRunningDiscoveryMessage();
+        sendMQTTWeightBasedDiscoveryMessage();
+        sendMQTTCloggedDiscoveryMessage();
+        sendMQTTFlowDiscoveryMessage();
+        sendMQTTScaleZeroDiscoveryMessage();
+        sendMQTTClogToleranceDiscoveryMessage();
+        sendMQTTPullbackDegreesDiscoveryMessage();
+        sendMQTTLastDosisDiscoveryMessage();
+        sendMQTTSpeedDiscoveryMessage();
+        sendMQTTScaleCalibrationDiscoveryMessage();
+        sendMQTTFeedIntervalDiscoveryMessage();
+        sendMQTTMotorMaxRunDiscoveryMessage();
+        sendMQTTMotorCooldownDiscoveryMessage();
+        sendMQTTErrorDiscoveryMessage();
+      }
+      client.subscribe(dosageCmdTopic.c_str(), MQTT_CMD_QOS);
+      client.subscribe(runningCmdTopic.c_str(), MQTT_CMD_QOS);
+      client.subscribe(weightBasedCmdTopic.c_str(), MQTT_CMD_QOS);
+      client.subscribe(flowCmdTopic.c_str(), MQTT_CMD_QOS);
+      client.subscribe(scaleZeroCmdTopic.c_str(), MQTT_CMD_QOS);
+      client.subscribe(clogToleranceCmdTopic.c_str(), MQTT_CMD_QOS);
+      client.subscribe(pullbackDegreesCmdTopic.c_str(), MQTT_CMD_QOS);
+      client.subscribe(speedCmdTopic.c_str(), MQTT_CMD_QOS);
+      client.subscribe(feedIntervalCmdTopic.c_str(), MQTT_CMD_QOS);
+      client.subscribe(motorMaxRunCmdTopic.c_str(), MQTT_CMD_QOS);
+      client.subscribe(motorCooldownCmdTopic.c_str(), MQTT_CMD_QOS);
+      client.subscribe(scaleCalibrationCmdTopic.c_str(), MQTT_CMD_QOS);
+      client.subscribe(traceCaptureCmdTopic.c_str(), MQTT_CMD_QOS);
+      client.subscribe(traceDownloadCmdTopic.c_str(), MQTT_CMD_QOS);
+      client.subscribe(traceReplayCmdTopic.c_str(), MQTT_CMD_QOS);
       
-      client.subscribe(MQTT_HASS_STATUS_TOPIC.c_str());
+      client.subscribe(MQTT_HASS_STATUS_TOPIC.c_str(), MQTT_CMD_QOS);
     } else {
       log("Failed mqtt connect with state " + String(client.state()));
-      delay(2000);
     }
   }
-  Serial.println("");
   if (client.connected()) {
     log("Connected to MQTT");
     setOnline();
+    flushPublishQueue();
     sendMqttStatus();
     lastMqttDiscovery = millis();
   } else {
@@ -606,7 +1393,7 @@ void wifiConnect() {
   WiFi.mode(WIFI_STA);
   WiFi.config(ip, gateway, subnet, dns1, dns2);
   WiFi.begin(WIFI_SSID, WIFI_PASSWORD);
-  while (WiFi.status() != WL_CONNECTED || millis()-start > WIFI_CONNECT_TIMEOUT)
+  while (WiFi.status() != WL_CONNECTED && millis()-start < WIFI_CONNECT_TIMEOUT)
   {  
     delay(1000);
     Serial.print(".");
@@ -622,6 +1409,206 @@ void wifiConnect() {
   }
 }
 
+#ifdef POWER_SAVE_MODE
+uint32_t rtcCrc(const RtcState &state) {
+  const uint8_t *data = (const uint8_t*)&state + sizeof(state.crc);
+  uint32_t crc = 0xFFFFFFFF;
+  for (size_t i = 0; i < sizeof(state)-sizeof(state.crc); i++) {
+    crc ^= data[i];
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (0xEDB88320 & (0-(crc & 1)));
+    }
+  }
+  return ~crc;
+}
+
+boolean restoreRtcState() {
+  RtcState state;
+  if (ESP.getResetInfoPtr()->reason != REASON_DEEP_SLEEP_AWAKE
+      || !ESP.rtcUserMemoryRead(0, (uint32_t*)&state, sizeof(state))
+      || state.magic != RTC_STATE_MAGIC || state.crc != rtcCrc(state)) {
+    return false;
+  }
+  hoursFrequency = state.hoursFrequency;
+  numberOfRevolutions = state.numberOfRevolutions;
+  amount = state.amount;
+  flow = state.flow;
+  scale_zero = state.scaleZero;
+  clog_tolerance = state.clogTolerance;
+  scale_error_range = state.scaleErrorRange;
+  pullbackSteps = state.pullbackSteps;
+  isWeightBased = state.isWeightBased;
+  speed = state.speed;
+  motorMaxRun = state.motorMaxRun;
+  motorCooldown = state.motorCooldown;
+  scale_calibration = state.scaleCalibration;
+  lastDosis = state.lastDosis;
+  feedDueInMs = state.feedDueInMs;
+  lastSleepMs = state.sleepMs;
+  lastAwakeMs = state.awakeMs;
+  wakeCount = state.wakeCount+1;
+  eventSeq = state.eventSeq;
+  uptimeOffsetMs = state.uptimeMs;
+  isClogged = state.isClogged;
+  feedEnergisedMs = state.feedEnergisedMs;
+  motorCooldowns = state.motorCooldowns;
+  publishQueueDrops = state.publishQueueDrops;
+  state.status[sizeof(state.status)-1] = '\0';
+  status = String(state.status);
+  return true;
+}
+
+void saveRtcState() {
+  RtcState state;
+  state.magic = RTC_STATE_MAGIC;
+  state.hoursFrequency = hoursFrequency;
+  state.numberOfRevolutions = numberOfRevolutions;
+  state.amount = amount;
+  state.flow = flow;
+  state.scaleZero = scale_zero;
+  state.clogTolerance = clog_tolerance;
+  state.scaleErrorRange = scale_error_range;
+  state.pullbackSteps = pullbackSteps;
+  state.isWeightBased = isWeightBased;
+  state.speed = speed;
+  state.motorMaxRun = motorMaxRun;
+  state.motorCooldown = motorCooldown;
+  state.scaleCalibration = scale_calibration;
+  state.lastDosis = lastDosis;
+  state.feedDueInMs = feedDueInMs;
+  state.sleepMs = lastSleepMs;
+  state.awakeMs = lastAwakeMs;
+  state.wakeCount = wakeCount;
+  state.eventSeq = eventSeq;
+  state.uptimeMs = uptimeOffsetMs;
+  state.isClogged = isClogged;
+  state.feedEnergisedMs = feedEnergisedMs;
+  state.motorCooldowns = motorCooldowns;
+  state.publishQueueDrops = publishQueueDrops;
+  strncpy(state.status, status.c_str(), sizeof(state.status)-1);
+  state.status[sizeof(state.status)-1] = '\0';
+  state.crc = rtcCrc(state);
+  ESP.rtcUserMemoryWrite(0, (uint32_t*)&state, sizeof(state));
+}
+
+// Counts down to the next scheduled feed by the time spent since the last
+// wake, as there is no clock running while asleep. Only hoursFrequency is
+// used: feedStartHour/feedStartMinutes are ignored, and the countdown drifts
+// with the RTC timer, which can be off by a few percent.
+boolean isScheduledFeedDue() {
+  if (hoursFrequency <= 0) {
+    return false;
+  }
+  uint32_t elapsed = lastSleepMs+lastAwakeMs;
+  if (!isWarmWake || feedDueInMs == 0) {
+    feedDueInMs = (uint32_t)hoursFrequency*3600000;
+    return false;
+  }
+  if (elapsed < feedDueInMs) {
+    feedDueInMs -= elapsed;
+    return false;
+  }
+  feedDueInMs = (uint32_t)hoursFrequency*3600000;
+  return true;
+}
+
+// Events that couldn't be published are kept in LittleFS while asleep, as
+// deep sleep wipes the RAM queue. One topic line and one payload line each.
+void spillPublishQueue() {
+  if (publishQueueCount == 0) {
+    return;
+  }
+  File file = LittleFS.open(QUEUE_SPILL_FILE, "w");
+  if (!file) {
+    log("Failed to spill publish queue");
+    return;
+  }
+  for (int i = 0; i < publishQueueCount; i++) {
+    QueuedMessage &msg = publishQueue[(publishQueueHead+i)%PUBLISH_QUEUE_SIZE];
+    file.print(msg.topic + "\n" + msg.payload + "\n");
+  }
+  file.close();
+  log("Spilled " + String(publishQueueCount) + " queued messages");
+}
+
+void restorePublishQueue() {
+  File file = LittleFS.open(QUEUE_SPILL_FILE, "r");
+  if (!file) {
+    return;
+  }
+  while (file.available()) {
+    String topic = file.readStringUntil('\n');
+    String payload = file.readStringUntil('\n');
+    if (topic != "") {
+      queueMessage(topic, payload);
+    }
+  }
+  file.close();
+  LittleFS.remove(QUEUE_SPILL_FILE);
+  log("Restored " + String(publishQueueCount) + " queued messages");
+}
+
+// Leaves the peripherals drawing as little as possible. The ESP8266 GPIOs
+// float in deep sleep, so the A4988 EN line needs its external pull-up to
+// stay disabled (see env:nodemcuv2_lowpower). The HX711 clock is on D4,
+// which the NodeMCU already pulls up, so it stays powered down.
+void powerDownPeripherals() {
+  motorOff();
+  digitalWrite(M1, LOW);
+  digitalWrite(M2, LOW);
+  digitalWrite(M3, LOW);
+  scale.power_down();
+}
+
+void goToSleep() {
+  if (!flushPublishQueue()) {
+    spillPublishQueue();
+  }
+  lastAwakeMs = millis();
+  lastSleepMs = POWER_SAVE_CHECKIN_INTERVAL;
+  if (hoursFrequency > 0 && feedDueInMs > lastAwakeMs) {
+    lastSleepMs = min(lastSleepMs, feedDueInMs-lastAwakeMs);
+  }
+  lastSleepMs = min((uint64_t)lastSleepMs, ESP.deepSleepMax()/1000);
+  log("Awake for " + String(lastAwakeMs) + "ms, sleeping " + String(lastSleepMs) + "ms");
+  uptimeOffsetMs += lastAwakeMs+lastSleepMs;
+  saveRtcState();
+  powerDownPeripherals();
+  client.disconnect();
+  ESP.deepSleep((uint64_t)lastSleepMs*1000);
+}
+#endif
+
+#ifdef WEIGHT_BENCHMARK
+// Compares the old conversion with the fixed-point one. Build with
+// -D WEIGHT_BENCHMARK to get the per-sample cycle counts on the serial log.
+// The old path is getWeight() as it was on scale.get_units(): HX711's
+// read_average() and double get_value(), then the divide by the float
+// SCALE. The HX711 read itself is left out of both.
+void benchmarkWeight() {
+  const int samples = 1000;
+  volatile long raw = 1234567;
+  volatile long offset = 0;
+  volatile byte times = 1;
+  volatile float scaleFactor = SCALE_CALIB_FACTOR;
+  volatile int sink = 0;
+  uint32_t start = ESP.getCycleCount();
+  for (int i = 0; i < samples; i++) {
+    long average = raw/times;
+    double value = average-offset;
+    float units = value/scaleFactor;
+    sink = (int)(units*1000)-scale_zero;
+  }
+  uint32_t floatCycles = (ESP.getCycleCount()-start)/samples;
+  start = ESP.getCycleCount();
+  for (int i = 0; i < samples; i++) {
+    sink = rawToGrams(raw, scale_q)-scale_zero;
+  }
+  uint32_t fixedCycles = (ESP.getCycleCount()-start)/samples;
+  log("Weight conversion cycles/sample float: " + String(floatCycles) + " fixed: " + String(fixedCycles));
+}
+#endif
+
 void setup() {
   status = "Setup";
   // Set stepper motor
@@ -639,33 +1626,82 @@ void setup() {
 
   Serial.begin(9600);
 
+#ifdef POWER_SAVE_MODE
+  isWarmWake = restoreRtcState();
+#endif
+
   // Load programmable data from eeprom
-  EEPROM.begin(EEPROM_SIZE);
-  EEPROM.get(FREQ_HOURS_ADDR, hoursFrequency);
-  EEPROM.get(REVS_ADDR, numberOfRevolutions);
-  EEPROM.get(FEED_START_HOUR_ADDR, feedStartHour);
-  EEPROM.get(FEED_START_MIN_ADDR, feedStartMinutes);
-  EEPROM.get(AMOUNT_ADDR, amount);
-  EEPROM.get(FLOW_ADDR, flow);
-  EEPROM.get(SCALE_FACTOR_ADDR, scale_zero);
-  EEPROM.get(CLOG_TOLERANCE_ADDR, clog_tolerance);
-  EEPROM.get(SCALE_ERROR_RANGE_ADDR, scale_error_range);
-  EEPROM.get(PULLBACK_STEPS_ADDR, pullbackSteps);
-  EEPROM.get(WEIGHT_BASED_ADDR, isWeightBased);
-  EEPROM.get(SPEED_ADDR, speed);
-  EEPROM.end();
+  if (!isWarmWake) {
+    EEPROM.begin(EEPROM_SIZE);
+    EEPROM.get(FREQ_HOURS_ADDR, hoursFrequency);
+    EEPROM.get(REVS_ADDR, numberOfRevolutions);
+    EEPROM.get(FEED_START_HOUR_ADDR, feedStartHour);
+    EEPROM.get(FEED_START_MIN_ADDR, feedStartMinutes);
+    EEPROM.get(AMOUNT_ADDR, amount);
+    EEPROM.get(FLOW_ADDR, flow);
+    EEPROM.get(SCALE_FACTOR_ADDR, scale_zero);
+    EEPROM.get(CLOG_TOLERANCE_ADDR, clog_tolerance);
+    EEPROM.get(SCALE_ERROR_RANGE_ADDR, scale_error_range);
+    EEPROM.get(PULLBACK_STEPS_ADDR, pullbackSteps);
+    EEPROM.get(WEIGHT_BASED_ADDR, isWeightBased);
+    EEPROM.get(SPEED_ADDR, speed);
+    EEPROM.get(SCALE_CALIBRATION_ADDR, scale_calibration);
+    EEPROM.get(MOTOR_MAX_RUN_ADDR, motorMaxRun);
+    EEPROM.get(MOTOR_COOLDOWN_ADDR, motorCooldown);
+    EEPROM.end();
+  }
   stepDelay = STEP_DEFAULT_DELAY/speed*10;
+  if (scale_calibration < SCALE_CALIB_MIN) {
+    scale_calibration = SCALE_CALIB_FACTOR;
+  }
+  if (hoursFrequency < 0) {
+    hoursFrequency = 0;
+  }
+  if (motorMaxRun <= 0) {
+    motorMaxRun = MOTOR_MAX_RUN_DEFAULT;
+  }
+  if (motorCooldown <= 0) {
+    motorCooldown = MOTOR_COOLDOWN_DEFAULT;
+  }
+  updateScaleQ();
+
+  if (!LittleFS.begin()) {
+    log("Failed to mount LittleFS");
+  }
+#ifdef POWER_SAVE_MODE
+  restorePublishQueue();
+#endif
 
   // Init wifi server
   wifiConnect();
+  setupLocalApi();
 
   // Scale init
   scale.begin(SCALE_DAT_PIN, SCALE_CLK_PIN);
-  scale.set_scale(SCALE_CALIB_FACTOR);
+  scale.power_up();
+#ifdef WEIGHT_BENCHMARK
+  benchmarkWeight();
+#endif
   
+#ifdef POWER_SAVE_MODE
+  log("Wake " + String(wakeCount) + (isWarmWake ? " restored from RTC" : " cold boot"));
+  boolean isFeedDue = isScheduledFeedDue();
+  // Without wifi there is nothing to check in with, but a due feed still
+  // runs and its events wait in the queue
+  if (!isFeedDue && WiFi.status() != WL_CONNECTED) {
+    goToSleep();
+  }
+#endif
+
   // MQTT init
   setupMqtt();
 
+#ifdef POWER_SAVE_MODE
+  if (isFeedDue) {
+    feed();
+  }
+#endif
+
   // Time init
   // timeClient.begin();
   
@@ -717,17 +1753,32 @@ void loop() {
   if (!WiFi.status() == WL_CONNECTED) {
     stat("Wifi disconnected with status: " + WiFi.status());
   }
-  if (!client.connected()) {
+  if (!client.connected() && millis()-lastMqttConnectAttempt >= MQTT_RECONNECT_INTERVAL) {
     log("Detected client disconnected.");
     if (status == "") {
       stat("MQTT Client disconnected");
     }
     setupMqtt();
   }
+  processLocalCommands();
   
   if (isRunning) {
-    digitalWrite(STEPPER_ENABLE_PIN, STEPPER_ENABLED);
-    if (isPullBack) {
+    if (isReplaying && isReplayDone) {
+      log("Trace replay ran out, ending feed");
+      endFeed();
+    } else if (isMotorCoolingDown()) {
+      if (!isCoolingDown) {
+        isCoolingDown = true;
+        motorCooldowns++;
+        stat(MOTOR_COOLDOWN_STATUS);
+        sendMqttStatus(runningWeight);
+      }
+    } else if (isCoolingDown) {
+      isCoolingDown = false;
+      if (status == MOTOR_COOLDOWN_STATUS) {
+        stat("");
+      }
+    } else if (isPullBack) {
       log("Start pullback: " + String(pullbackSteps));
       pull(pullbackSteps);
       push(pullbackSteps);
@@ -754,8 +1805,14 @@ void loop() {
       }
     }
   } else {
-    digitalWrite(STEPPER_ENABLE_PIN, STEPPER_DISABLED);
+    motorOff();
     unsigned long exTime = millis();
+#ifdef POWER_SAVE_MODE
+    // Stay up just long enough to take commands after the last status
+    if (pendingCommands.empty() && exTime-lastMqttUpdateTime > POWER_SAVE_LISTEN_WINDOW) {
+      goToSleep();
+    }
+#endif
     if (exTime < lastMqttUpdateTime || exTime-lastMqttUpdateTime > MQTT_PERIODIC_UPDATE_INTERVAL) {
       sendMqttStatus();
     }
@@ -764,4 +1821,6 @@ void loop() {
     }
   }
   client.loop();
+  sampleWsWeight();
+  ws.cleanupClients();
 }